@@ -1,7 +1,7 @@
 #!/bin/bash
 
 FLAGS="-g3 -Wall -Wextra -pedantic -Wconversion"
-FILES="t2j_linux.c t2j.c -o t2j"
+FILES="t2j_linux.c t2j.c -pthread -o t2j"
 
 case $1 in
     warn)
@@ -17,6 +17,83 @@ case $1 in
 	    echo "  Bencode: $(cat $file)"
 	    echo "  Result:  $(./t2j $file)"
 	done
+	for file in ./tests/utf8/*.txt; do
+	    [ -f "$file" ] || break
+	    echo "============="
+	    echo "Running test: -u $file"
+	    echo "  Bencode: $(cat -A $file | tr -d "\n")"
+	    echo "  Result:  $(./t2j -u $file)"
+	done
+	echo "============="
+	echo "Running test: ./tests/dir (directory)"
+	./t2j ./tests/dir 2>&1 | sed 's/^/  Result:  /'
+	echo "============="
+	echo "Running test: ./tests/int.txt (piped through /dev/stdin)"
+	echo "  Result:  $(cat ./tests/int.txt | ./t2j /dev/stdin)"
+	for file in ./tests/formats/*.txt; do
+	    [ -f "$file" ] || break
+	    for format in cbor msgpack; do
+		echo "============="
+		echo "Running test: -o $format $file"
+		echo "  Result:  $(./t2j -o $format $file | od -An -tx1 -v | xargs)"
+	    done
+	done
+	index=$(mktemp)
+	echo "============="
+	echo "Running test: index build ./tests/index"
+	echo "  Result:  $(./t2j index build ./tests/index $index 2>&1)"
+	echo "============="
+	echo "Running test: index build ./tests/index (again, unchanged files are not decoded)"
+	echo "  Result:  $(./t2j index build ./tests/index $index 2>/dev/null)"
+	for hash in ea6d1c6d3773da89e706b3d0436a7b4b8fc8b2b9 fba3e0da49595ed88e1fdbd8633aadcb7739b57c \
+		    8aa9d3c65b0164d222d9b2527a70f125668575ef 0000000000000000000000000000000000000000; do
+	    echo "============="
+	    echo "Running test: index lookup $hash"
+	    ./t2j index lookup $hash $index | sed 's/^/  Result:  /'
+	    echo "  Exit:    ${PIPESTATUS[0]}"
+	done
+	rm -f $index
+	for file in ./tests/check/*.txt; do
+	    [ -f "$file" ] || break
+	    echo "============="
+	    echo "Running test: -c $file"
+	    echo "  Bencode: $(cat $file)"
+	    echo "  Result:  $(./t2j -c $file 2>&1)"
+	    echo "  Exit:    $(./t2j -c $file > /dev/null 2>&1; echo $?)"
+	done
+	echo "============="
+	echo "Running test: -c ./tests/check/valid.txt (piped through /dev/stdin)"
+	echo "  Exit:    $(cat ./tests/check/valid.txt | ./t2j -c /dev/stdin; echo $?)"
+	for file in ./tests/diff/*.a.txt; do
+	    [ -f "$file" ] || break
+	    other="${file%.a.txt}.b.txt"
+	    echo "============="
+	    echo "Running test: --diff $file $other"
+	    echo "  Bencode: $(cat $file)"
+	    echo "  Bencode: $(cat $other)"
+	    echo "  Result:  $(./t2j --diff $file $other)"
+	done
+	;;
+    bench)
+        gcc $FLAGS $FILES
+	# Decodes COUNT generated files from a cold page cache, DIRECTORY should be on the disk to measure (not a tmpfs)
+	count=${2:-10000}
+	dir=$(mktemp -d "${3:-.}/t2j-bench.XXXXXX")
+	for i in $(seq 1 $count); do
+	    name="file-$i"
+	    printf -v pieces '%020d' $i
+	    info="d6:lengthi${i}e4:name${#name}:${name}12:piece lengthi16384e6:pieces20:${pieces}e"
+	    printf 'd8:announce18:udp://tracker:13374:info%se' "$info" > $dir/$name.torrent
+	done
+	sync
+	if { echo 3 > /proc/sys/vm/drop_caches; } 2>/dev/null; then
+	    echo "Dropped the page cache"
+	else
+	    echo "Unable to drop the page cache (requires root), the files are likely still cached"
+	fi
+	echo "Decoding $count files in $dir"
+	time ./t2j $dir > /dev/null
+	rm -rf $dir
 	;;
     *)
 	gcc -03 $FILES;;
@@ -1,4 +1,9 @@
 #include "t2j.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define Assert(expression)                                                                                             \
     while (!(expression))                                                                                              \
@@ -14,9 +19,11 @@ static u8 StateTransitions[6][5] = {{6, 6, 1, 3, 6}, {2, 2, 1, 3, 6}, {2, 2, 1,
 static void *ArenaPush(arena *Arena, u64 Size)
 {
     // TODO: We can run OOM (we only allocate 1Gb atm), make more allocations when needed, e.g. through a linked list
+    // Keep every allocation 8 byte aligned
+    Size = (Size + 7) & ~(u64)7;
     void *Memory = Arena->Memory;
     Arena->Offset += Size;
-    Arena->Memory = (u8 *)Arena->Memory + Arena->Offset;
+    Arena->Memory = (u8 *)Arena->Memory + Size;
     return Memory;
 }
 
@@ -134,6 +141,49 @@ static int StringEquals(byte *A, byte *B)
     return 1;
 }
 
+#define HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+static u64 HashCombine(u64 Hash, u64 Value)
+{
+    Hash = (Hash ^ Value) * HASH_MULTIPLIER;
+    return Hash ^ (Hash >> 29);
+}
+
+// NOTE: Not cryptographic, only used to skip identical subtrees when diffing
+static u64 HashBytes(u64 Seed, byte *Data, u32 Length)
+{
+    u64 Hash = HashCombine(Seed, Length);
+    u32 Index = 0;
+
+    for (; Index + 8 <= Length; Index += 8)
+    {
+        u64 Word;
+        memcpy(&Word, Data + Index, sizeof(Word));
+        Hash = HashCombine(Hash, Word);
+    }
+
+    u64 Tail = 0;
+    for (; Index < Length; Index++)
+    {
+        Tail = (Tail << 8) | (u8)Data[Index];
+    }
+
+    return HashCombine(Hash, Tail);
+}
+
+// Hash of a list or dict, from the (already computed) hashes of its children
+static u64 HashChildren(node *Node)
+{
+    u64 Hash = HashCombine(Node->Type + 1, Node->ByteLength);
+
+    for (node *Child = Node->Head; Child; Child = Child->Next)
+    {
+        Hash = HashCombine(Hash, Child->Hash);
+    }
+
+    return Hash;
+}
+
 static void Bencode(byte *Destination, node *Node)
 {
     node *Current = Node;
@@ -200,241 +250,706 @@ static void Bencode(byte *Destination, node *Node)
     }
 }
 
-static void PrintJSON(context *Context, node *Node)
+// Returns the index of the first byte (from Offset) that has to be escaped within a JSON string, or Length if none
+static u32 FindEscape(byte *Data, u32 Offset, u32 Length)
+{
+    u32 Index = Offset;
+
+#if defined(__SSE2__)
+    // NOTE: 16 bytes at a time, a byte needs escaping if it is '"', '\\' or a control character (<= 0x1F)
+    __m128i Quote = _mm_set1_epi8('"');
+    __m128i Backslash = _mm_set1_epi8('\\');
+    __m128i Control = _mm_set1_epi8(0x1F);
+
+    for (; Index + 16 <= Length; Index += 16)
+    {
+        __m128i Chunk = _mm_loadu_si128((__m128i *)(Data + Index));
+        __m128i Mask = _mm_or_si128(_mm_cmpeq_epi8(Chunk, Quote), _mm_cmpeq_epi8(Chunk, Backslash));
+        // Unsigned "less than or equal" through max(Chunk, 0x1F) == 0x1F
+        Mask = _mm_or_si128(Mask, _mm_cmpeq_epi8(_mm_max_epu8(Chunk, Control), Control));
+        u32 Bits = (u32)_mm_movemask_epi8(Mask);
+
+        if (Bits)
+        {
+            return Index + (u32)__builtin_ctz(Bits);
+        }
+    }
+#endif
+
+    for (; Index < Length; Index++)
+    {
+        u8 Character = (u8)Data[Index];
+
+        if (Character == '"' || Character == '\\' || Character < 0x20)
+        {
+            return Index;
+        }
+    }
+
+    return Length;
+}
+
+void PrintJSONString(byte *Data, u32 Length)
+{
+    printf("\"");
+    u32 Start = 0;
+
+    while (Start < Length)
+    {
+        u32 End = FindEscape(Data, Start, Length);
+
+        // Copy the clean run in bulk
+        fwrite(Data + Start, sizeof(byte), End - Start, stdout);
+
+        if (End == Length)
+        {
+            break;
+        }
+
+        u8 Character = (u8)Data[End];
+
+        switch (Character)
+        {
+        case '"':
+            printf("\\\"");
+            break;
+        case '\\':
+            printf("\\\\");
+            break;
+        case '\b':
+            printf("\\b");
+            break;
+        case '\f':
+            printf("\\f");
+            break;
+        case '\n':
+            printf("\\n");
+            break;
+        case '\r':
+            printf("\\r");
+            break;
+        case '\t':
+            printf("\\t");
+            break;
+        default:
+            printf("\\u%04x", Character);
+            break;
+        }
+
+        Start = End + 1;
+    }
+
+    printf("\"");
+}
+
+static u8 IsInfoEntry(context *Context, node *Node)
+{
+    return Context->Flags.PrintInfoHash && Node->Type == BENCODE_DICT_ENTRY && Node->Head->Type == BENCODE_DICT &&
+           Node->String->Length == 4 && StringEquals(Node->String->Data, "info");
+}
+
+static void InfoHash(context *Context, node *Entry, byte *Hash)
+{
+    u32 Length = Entry->Head->ByteLength;
+    byte *Buffer = PushArray(Context->Arena, byte, Length);
+    Bencode(Buffer, Entry->Head);
+    SHA1Digest(Context, Hash, Buffer, Length);
+}
+
+// Depth first walk of the tree, Visit is called when entering (Process = 1) and leaving (Process = 0) a node
+static void Traverse(context *Context, node *Node, visit_node *Visit)
 {
     node *Current = Node;
     u8 Process = 1;
 
     while (Current)
     {
-        if (Process)
+        Visit(Context, Current, Process);
+
+        // NOTE: We've reached our original node
+        if (!Process && Current == Node)
         {
-            switch (Current->Type)
+            break;
+        }
+
+        // Depth first
+        if (Current->Head && Process)
+        {
+            Current = Current->Head;
+            Process = 1;
+        }
+        else if (Current->Next)
+        {
+            Current = Current->Next;
+            Process = 1;
+        }
+        else
+        {
+            Current = Current->Parent;
+            Process = 0;
+        }
+    }
+}
+
+static void VisitJSON(context *Context, node *Current, u8 Process)
+{
+    if (Process)
+    {
+        switch (Current->Type)
+        {
+        case BENCODE_STR:
+            if (Current->String->IsBinary)
             {
-            case BENCODE_STR:
-                if (Current->String->IsBinary)
+                if (Context->Flags.PrintBinary)
                 {
-                    if (Context->Flags.PrintBinary)
+                    if (Context->Flags.BinaryInHex)
                     {
-                        if (Context->Flags.BinaryInHex)
-                        {
-                            printf("\"");
-                            for (u32 StringIndex = 0; StringIndex < Current->String->Length; StringIndex++)
-                            {
-                                printf("0x%02hhX", Current->String->Data[StringIndex]);
-                            }
-                            printf("\"");
-                        }
-                        else
+                        printf("\"");
+                        for (u32 StringIndex = 0; StringIndex < Current->String->Length; StringIndex++)
                         {
-                            fwrite(Current->String->Data, sizeof(byte), Current->String->Length, stdout);
+                            printf("0x%02hhX", Current->String->Data[StringIndex]);
                         }
+                        printf("\"");
                     }
                     else
                     {
-                        printf(Current->Next ? "\"[BLOB]\"," : "\"[BLOB]\"");
+                        fwrite(Current->String->Data, sizeof(byte), Current->String->Length, stdout);
                     }
                 }
                 else
                 {
-                    printf(Current->Next ? "\"%.*s\"," : "\"%.*s\"", Current->String->Length, Current->String->Data);
+                    printf(Current->Next ? "\"[BLOB]\"," : "\"[BLOB]\"");
                 }
-                break;
-            case BENCODE_INT:
-                printf(Current->Next ? "%ld," : "%ld", Current->Integer);
-                break;
-            case BENCODE_LIST:
-                printf(Current->Head ? "[" : "[],");
-                break;
-            case BENCODE_DICT:
-                printf(Current->Head ? "{" : "{},}");
-                break;
-            case BENCODE_DICT_ENTRY:
-                printf("\"%.*s\":", Current->String->Length, Current->String->Data);
-                break;
-            }
-        }
-        else
-        {
-            // This is when we're going up the list
-            if (Current->Type == BENCODE_LIST)
-            {
-                printf(Current->Next ? "]," : "]");
-            }
-            else if (Current->Type == BENCODE_DICT)
-            {
-                printf(Current->Next ? "}," : "}");
             }
-            else if (Current->Type == BENCODE_DICT_ENTRY)
+            else
             {
-                if (Context->Flags.PrintInfoHash && Current->Head->Type == BENCODE_DICT &&
-                    StringEquals(Current->String->Data, "info"))
-                {
-                    u32 Length = Current->Head->ByteLength;
-                    byte *Buffer = PushArray(Context->Arena, byte, Length);
-                    Bencode(Buffer, Current->Head);
-                    byte Hash[41];
-                    SHA1Digest(Context, Hash, Buffer, Length);
-                    printf(",\"info_hash\":\"%s\"", Hash);
-                }
+                PrintJSONString(Current->String->Data, Current->String->Length);
 
                 if (Current->Next)
                 {
                     printf(",");
                 }
             }
-
-            // NOTE: We've reached our original node
-            if (Current == Node)
-            {
-                break;
-            }
+            break;
+        case BENCODE_INT:
+            printf(Current->Next ? "%ld," : "%ld", Current->Integer);
+            break;
+        case BENCODE_LIST:
+            printf(Current->Head ? "[" : Current->Next ? "[]," : "[]");
+            break;
+        case BENCODE_DICT:
+            printf(Current->Head ? "{" : Current->Next ? "{}," : "{}");
+            break;
+        case BENCODE_DICT_ENTRY:
+            PrintJSONString(Current->String->Data, Current->String->Length);
+            printf(":");
+            break;
         }
-
-        // Depth first
-        if (Current->Head && Process)
+    }
+    else
+    {
+        // This is when we're going up the list
+        if (Current->Type == BENCODE_LIST)
         {
-            Current = Current->Head;
-            Process = 1;
+            printf(Current->Next ? "]," : "]");
         }
-        else if (Current->Next)
+        else if (Current->Type == BENCODE_DICT)
         {
-            Current = Current->Next;
-            Process = 1;
+            printf(Current->Next ? "}," : "}");
         }
-        else
+        else if (Current->Type == BENCODE_DICT_ENTRY)
         {
-            Current = Current->Parent;
-            Process = 0;
+            if (IsInfoEntry(Context, Current))
+            {
+                byte Hash[41];
+                InfoHash(Context, Current, Hash);
+                printf(",\"info_hash\":\"%s\"", Hash);
+            }
+
+            if (Current->Next)
+            {
+                printf(",");
+            }
         }
     }
 }
 
-static string_result ConsumeString(context *Context)
+static void PrintJSON(context *Context, node *Node)
 {
-    string *String = PushStruct(Context->Arena, string);
-    String->IsBinary = 0;
-    String->Data = 0;
-    String->Length = 0;
+    Traverse(Context, Node, VisitJSON);
+}
 
-    byte Character = (byte)fgetc(Context->Stream);
-    Context->BytesRead++;
+static void SinkFlush(sink *Sink)
+{
+    fwrite(Sink->Buffer, sizeof(byte), Sink->Used, stdout);
+    Sink->Used = 0;
+}
 
-    while (Character != EOF && Character != ':')
+static void SinkWrite(sink *Sink, void *Data, u32 Length)
+{
+    if (Sink->Used + Length > SINK_SIZE)
     {
-        if (Character < '0' || Character > '9')
+        SinkFlush(Sink);
+
+        // Large strings (e.g. 'pieces') are written directly
+        if (Length > SINK_SIZE)
         {
-            string_result Result = {0, "invalid string, non-numerical character for size"};
-            return Result;
+            fwrite(Data, sizeof(byte), Length, stdout);
+            return;
         }
-
-        String->Length = (String->Length * 10) + (u32)(Character - '0');
-        Character = (byte)fgetc(Context->Stream);
-        Context->BytesRead++;
-    }
-
-    if (Character == EOF)
-    {
-        string_result Result = {0, "invalid string, no string after size declaration"};
-        return Result;
     }
 
-    Assert(Character == ':');
-
-    if (String->Length == 0)
-    {
-        string_result Result = {String, 0};
-        return Result;
-    }
+    memcpy(Sink->Buffer + Sink->Used, Data, Length);
+    Sink->Used += Length;
+}
 
-    String->Data = PushArray(Context->Arena, byte, String->Length);
+// Writes Lead followed by the Size lowest bytes of Value (big-endian)
+static void SinkHeader(sink *Sink, u8 Lead, u8 Size, u64 Value)
+{
+    u8 Header[9];
+    Header[0] = Lead;
 
-    // NOTE: we don't check for EOF since some binary data might be set to -1
-    for (u32 Index = 0; Index < String->Length; Index++)
+    for (u8 Index = 0; Index < Size; Index++)
     {
-        Character = (byte)fgetc(Context->Stream);
-        String->Data[Index] = Character;
-        Context->BytesRead++;
-
-        if (!String->IsBinary && (Character < 32 || Character > 126))
-        {
-            String->IsBinary = 1;
-        }
+        Header[1 + Index] = (u8)(Value >> (8 * (Size - 1 - Index)));
     }
 
-    string_result Result = {String, 0};
-    return Result;
+    SinkWrite(Sink, Header, Size + 1u);
 }
 
-static integer_result ConsumeInteger(context *Context)
+static void WriteCBORHeader(sink *Sink, u8 Major, u64 Value)
 {
-    byte Character = (byte)fgetc(Context->Stream);
-    Context->BytesRead++;
+    Major = (u8)(Major << 5);
 
-    if (Character == EOF || Character == 'e')
+    if (Value < 24)
     {
-        integer_result Result = {0, "invalid integer, empty"};
-        return Result;
+        SinkHeader(Sink, Major | (u8)Value, 0, 0);
     }
-
-    byte Peek = (byte)fgetc(Context->Stream);
-    ungetc(Peek, Context->Stream);
-
-    if (Character == '-' && Peek == '0')
+    else if (Value <= 0xFF)
     {
-        integer_result Result = {0, "invalid integer, negative zero"};
-        return Result;
+        SinkHeader(Sink, Major | 24, 1, Value);
     }
-
-    if (Character == '0' && Peek != 'e')
+    else if (Value <= 0xFFFF)
     {
-        integer_result Result = {0, "invalid integer, leading zero"};
-        return Result;
+        SinkHeader(Sink, Major | 25, 2, Value);
     }
-
-    u8 Signed = 0;
-
-    if (Character == '-')
+    else if (Value <= 0xFFFFFFFF)
     {
-        Signed = 1;
-        Character = (byte)fgetc(Context->Stream);
-        Context->BytesRead++;
+        SinkHeader(Sink, Major | 26, 4, Value);
+    }
+    else
+    {
+        SinkHeader(Sink, Major | 27, 8, Value);
     }
+}
 
-    i64 Integer = 0;
+static void WriteInteger(context *Context, i64 Value)
+{
+    sink *Sink = Context->Sink;
 
-    while (Character != EOF && Character != 'e')
+    if (Context->Format == OUTPUT_CBOR)
     {
-        if (Character < '0' || Character > '9')
+        // Negative integers are encoded as -1 - N
+        WriteCBORHeader(Sink, Value < 0 ? 1 : 0, Value < 0 ? ~(u64)Value : (u64)Value);
+    }
+    else if (Value >= 0)
+    {
+        if (Value < 128)
         {
-            integer_result Result = {0, "invalid integer, non-numerical"};
-            return Result;
+            SinkHeader(Sink, (u8)Value, 0, 0);
+        }
+        else if (Value <= 0xFF)
+        {
+            SinkHeader(Sink, 0xCC, 1, (u64)Value);
+        }
+        else if (Value <= 0xFFFF)
+        {
+            SinkHeader(Sink, 0xCD, 2, (u64)Value);
+        }
+        else if (Value <= 0xFFFFFFFF)
+        {
+            SinkHeader(Sink, 0xCE, 4, (u64)Value);
+        }
+        else
+        {
+            SinkHeader(Sink, 0xCF, 8, (u64)Value);
         }
-
-        Integer = (Integer * 10) + (i64)(Character - '0');
-        Character = (byte)fgetc(Context->Stream);
-        Context->BytesRead++;
     }
-
-    if (Character == EOF)
+    else
     {
-        integer_result Result = {0, "invalid integer, EOF"};
-        return Result;
+        if (Value >= -32)
+        {
+            SinkHeader(Sink, (u8)Value, 0, 0);
+        }
+        else if (Value >= INT8_MIN)
+        {
+            SinkHeader(Sink, 0xD0, 1, (u64)Value);
+        }
+        else if (Value >= INT16_MIN)
+        {
+            SinkHeader(Sink, 0xD1, 2, (u64)Value);
+        }
+        else if (Value >= INT32_MIN)
+        {
+            SinkHeader(Sink, 0xD2, 4, (u64)Value);
+        }
+        else
+        {
+            SinkHeader(Sink, 0xD3, 8, (u64)Value);
+        }
     }
-
-    Assert(Character == 'e');
-    integer_result Result = {Signed ? -Integer : Integer, 0};
-    return Result;
 }
 
-static parse_result Parse(context *Context)
+// Binary strings are written as byte strings (bin in MessagePack) and everything else as text strings
+static void WriteString(context *Context, u8 IsBinary, byte *Data, u32 Length)
 {
-    string_result StringResult = {0};
-    integer_result IntegerResult = {0};
+    sink *Sink = Context->Sink;
 
-    enum parse_state NextState = PARSE_EMPTY;
-    node *Next = {0};
-    node *Current = {0};
+    if (Context->Format == OUTPUT_CBOR)
+    {
+        WriteCBORHeader(Sink, IsBinary ? 2 : 3, Length);
+    }
+    else if (IsBinary)
+    {
+        if (Length <= 0xFF)
+        {
+            SinkHeader(Sink, 0xC4, 1, Length);
+        }
+        else if (Length <= 0xFFFF)
+        {
+            SinkHeader(Sink, 0xC5, 2, Length);
+        }
+        else
+        {
+            SinkHeader(Sink, 0xC6, 4, Length);
+        }
+    }
+    else
+    {
+        if (Length < 32)
+        {
+            SinkHeader(Sink, (u8)(0xA0 | Length), 0, 0);
+        }
+        else if (Length <= 0xFF)
+        {
+            SinkHeader(Sink, 0xD9, 1, Length);
+        }
+        else if (Length <= 0xFFFF)
+        {
+            SinkHeader(Sink, 0xDA, 2, Length);
+        }
+        else
+        {
+            SinkHeader(Sink, 0xDB, 4, Length);
+        }
+    }
+
+    SinkWrite(Sink, Data, Length);
+}
+
+// Both formats need the number of elements (or key/value pairs) up front
+static void WriteContainer(context *Context, node *Node)
+{
+    sink *Sink = Context->Sink;
+    u8 IsMap = Node->Type == BENCODE_DICT;
+    u32 Count = 0;
+
+    for (node *Child = Node->Head; Child; Child = Child->Next)
+    {
+        // The info hash is an additional entry
+        Count += IsInfoEntry(Context, Child) ? 2 : 1;
+    }
+
+    if (Context->Format == OUTPUT_CBOR)
+    {
+        WriteCBORHeader(Sink, IsMap ? 5 : 4, Count);
+    }
+    else if (Count < 16)
+    {
+        SinkHeader(Sink, (u8)((IsMap ? 0x80 : 0x90) | Count), 0, 0);
+    }
+    else if (Count <= 0xFFFF)
+    {
+        SinkHeader(Sink, IsMap ? 0xDE : 0xDC, 2, Count);
+    }
+    else
+    {
+        SinkHeader(Sink, IsMap ? 0xDF : 0xDD, 4, Count);
+    }
+}
+
+static void VisitBinary(context *Context, node *Current, u8 Process)
+{
+    if (Process)
+    {
+        switch (Current->Type)
+        {
+        case BENCODE_STR:
+        case BENCODE_DICT_ENTRY:
+            WriteString(Context, Current->String->IsBinary, Current->String->Data, Current->String->Length);
+            break;
+        case BENCODE_INT:
+            WriteInteger(Context, Current->Integer);
+            break;
+        case BENCODE_LIST:
+        case BENCODE_DICT:
+            WriteContainer(Context, Current);
+            break;
+        }
+    }
+    else if (IsInfoEntry(Context, Current))
+    {
+        byte Hash[41];
+        InfoHash(Context, Current, Hash);
+        WriteString(Context, 0, "info_hash", 9);
+        WriteString(Context, 0, Hash, 40);
+    }
+}
+
+// CBOR or MessagePack, through a buffered sink
+static void PrintBinary(context *Context, node *Node)
+{
+    Context->Sink = PushStruct(Context->Arena, sink);
+
+    // NOTE: When processing several files each value is wrapped with the name of its file
+    if (Context->Filename)
+    {
+        if (Context->Format == OUTPUT_CBOR)
+        {
+            WriteCBORHeader(Context->Sink, 5, 2);
+        }
+        else
+        {
+            SinkHeader(Context->Sink, 0x82, 0, 0);
+        }
+
+        WriteString(Context, 0, "file", 4);
+        WriteString(Context, 0, Context->Filename, (u32)strlen(Context->Filename));
+        WriteString(Context, 0, "value", 5);
+    }
+
+    Traverse(Context, Node, VisitBinary);
+    SinkFlush(Context->Sink);
+}
+
+// Returns 1 if Data is well-formed UTF-8 (no overlong encodings, surrogates or code points above U+10FFFF)
+static u8 IsValidUTF8(byte *Data, u32 Length)
+{
+    u32 Index = 0;
+
+    while (Index < Length)
+    {
+        // Skip runs of ASCII 8 bytes at a time
+        while (Index + 8 <= Length)
+        {
+            u64 Word = 0;
+            memcpy(&Word, Data + Index, sizeof(Word));
+
+            if (Word & 0x8080808080808080ULL)
+            {
+                break;
+            }
+
+            Index += 8;
+        }
+
+        if (Index >= Length)
+        {
+            break;
+        }
+
+        u8 Lead = (u8)Data[Index];
+
+        if (Lead < 0x80)
+        {
+            Index++;
+            continue;
+        }
+
+        u32 Count = 0;
+        u8 Min = 0x80;
+        u8 Max = 0xBF;
+
+        if (Lead >= 0xC2 && Lead <= 0xDF)
+        {
+            Count = 1;
+        }
+        else if (Lead >= 0xE0 && Lead <= 0xEF)
+        {
+            Count = 2;
+            Min = Lead == 0xE0 ? 0xA0 : 0x80;
+            Max = Lead == 0xED ? 0x9F : 0xBF;
+        }
+        else if (Lead >= 0xF0 && Lead <= 0xF4)
+        {
+            Count = 3;
+            Min = Lead == 0xF0 ? 0x90 : 0x80;
+            Max = Lead == 0xF4 ? 0x8F : 0xBF;
+        }
+        else
+        {
+            return 0;
+        }
+
+        if (Length - Index <= Count)
+        {
+            return 0;
+        }
+
+        // NOTE: Only the first continuation byte has a restricted range
+        u8 Continuation = (u8)Data[Index + 1];
+
+        if (Continuation < Min || Continuation > Max)
+        {
+            return 0;
+        }
+
+        for (u32 Offset = 2; Offset <= Count; Offset++)
+        {
+            Continuation = (u8)Data[Index + Offset];
+
+            if (Continuation < 0x80 || Continuation > 0xBF)
+            {
+                return 0;
+            }
+        }
+
+        Index += Count + 1;
+    }
+
+    return 1;
+}
+
+static string_result ConsumeString(context *Context)
+{
+    string *String = PushStruct(Context->Arena, string);
+    String->IsBinary = 0;
+    String->Data = 0;
+    String->Length = 0;
+
+    byte Character = (byte)fgetc(Context->Stream);
+    Context->BytesRead++;
+
+    while (Character != EOF && Character != ':')
+    {
+        if (Character < '0' || Character > '9')
+        {
+            string_result Result = {0, "invalid string, non-numerical character for size"};
+            return Result;
+        }
+
+        String->Length = (String->Length * 10) + (u32)(Character - '0');
+        Character = (byte)fgetc(Context->Stream);
+        Context->BytesRead++;
+    }
+
+    if (Character == EOF)
+    {
+        string_result Result = {0, "invalid string, no string after size declaration"};
+        return Result;
+    }
+
+    Assert(Character == ':');
+
+    if (String->Length == 0)
+    {
+        string_result Result = {String, 0};
+        return Result;
+    }
+
+    String->Data = PushArray(Context->Arena, byte, String->Length);
+
+    // NOTE: we don't check for EOF since some binary data might be set to -1
+    for (u32 Index = 0; Index < String->Length; Index++)
+    {
+        Character = (byte)fgetc(Context->Stream);
+        String->Data[Index] = Character;
+        Context->BytesRead++;
+
+        if (!String->IsBinary && (Character < 32 || Character > 126))
+        {
+            String->IsBinary = 1;
+        }
+    }
+
+    if (String->IsBinary && Context->Flags.AllowUTF8)
+    {
+        String->IsBinary = !IsValidUTF8(String->Data, String->Length);
+    }
+
+    string_result Result = {String, 0};
+    return Result;
+}
+
+static integer_result ConsumeInteger(context *Context)
+{
+    byte Character = (byte)fgetc(Context->Stream);
+    Context->BytesRead++;
+
+    if (Character == EOF || Character == 'e')
+    {
+        integer_result Result = {0, "invalid integer, empty"};
+        return Result;
+    }
+
+    byte Peek = (byte)fgetc(Context->Stream);
+    ungetc(Peek, Context->Stream);
+
+    if (Character == '-' && Peek == '0')
+    {
+        integer_result Result = {0, "invalid integer, negative zero"};
+        return Result;
+    }
+
+    if (Character == '0' && Peek != 'e')
+    {
+        integer_result Result = {0, "invalid integer, leading zero"};
+        return Result;
+    }
+
+    u8 Signed = 0;
+
+    if (Character == '-')
+    {
+        Signed = 1;
+        Character = (byte)fgetc(Context->Stream);
+        Context->BytesRead++;
+    }
+
+    i64 Integer = 0;
+
+    while (Character != EOF && Character != 'e')
+    {
+        if (Character < '0' || Character > '9')
+        {
+            integer_result Result = {0, "invalid integer, non-numerical"};
+            return Result;
+        }
+
+        Integer = (Integer * 10) + (i64)(Character - '0');
+        Character = (byte)fgetc(Context->Stream);
+        Context->BytesRead++;
+    }
+
+    if (Character == EOF)
+    {
+        integer_result Result = {0, "invalid integer, EOF"};
+        return Result;
+    }
+
+    Assert(Character == 'e');
+    integer_result Result = {Signed ? -Integer : Integer, 0};
+    return Result;
+}
+
+static parse_result Parse(context *Context)
+{
+    string_result StringResult = {0};
+    integer_result IntegerResult = {0};
+
+    enum parse_state NextState = PARSE_EMPTY;
+    node *Next = {0};
+    node *Current = {0};
     byte Character = (byte)fgetc(Context->Stream);
     Context->BytesRead++;
 
@@ -469,6 +984,10 @@ static parse_result Parse(context *Context)
 
             Next->String = StringResult.Value;
             Next->ByteLength = Context->BytesRead - Next->ByteLength;
+            if (Context->Flags.HashSubtrees)
+            {
+                Next->Hash = HashBytes(Next->Type + 1, Next->String->Data, Next->String->Length);
+            }
         }
         else if (Character == 'i')
         {
@@ -486,6 +1005,10 @@ static parse_result Parse(context *Context)
 
             Next->Integer = IntegerResult.Value;
             Next->ByteLength = Context->BytesRead - Next->ByteLength + 1;
+            if (Context->Flags.HashSubtrees)
+            {
+                Next->Hash = HashCombine(BENCODE_INT + 1, (u64)Next->Integer);
+            }
         }
         else if (Character == 'l')
         {
@@ -501,11 +1024,29 @@ static parse_result Parse(context *Context)
         }
         else if (Character == 'e')
         {
-            Current = Current->Parent;
+            if (!Current)
+            {
+                parse_result Result = {0, "unexpected end of list or dict"};
+                return Result;
+            }
 
-            if (Current->Type == BENCODE_LIST || Current->Type == BENCODE_DICT)
+            if (NextState == PARSE_ENTRY_VALUE)
+            {
+                parse_result Result = {0, "dict key without a value"};
+                return Result;
+            }
+
+            // An empty list or dict is closed itself, otherwise Current is its last child
+            if (NextState != PARSE_NEW_LIST && NextState != PARSE_NEW_DICT)
+            {
+                Current = Current->Parent;
+            }
+
+            Current->ByteLength = Context->BytesRead - Current->ByteLength + 1;
+
+            if (Context->Flags.HashSubtrees)
             {
-                Current->ByteLength = Context->BytesRead - Current->ByteLength + 1;
+                Current->Hash = HashChildren(Current);
             }
 
             if (!Current->Parent)
@@ -523,6 +1064,12 @@ static parse_result Parse(context *Context)
             {
                 // For dictionary entries we need to go up another step
                 Current = Current->Parent;
+
+                if (Context->Flags.HashSubtrees)
+                {
+                    Current->Hash = HashCombine(Current->Hash, Current->Head->Hash);
+                }
+
                 NextState = PARSE_APPEND_DICT;
             }
 
@@ -573,6 +1120,11 @@ static parse_result Parse(context *Context)
             {
                 Current = Current->Head;
             }
+            else if (Context->Flags.HashSubtrees)
+            {
+                // The entry hash (of its key) is completed by its value
+                Current->Hash = HashCombine(Current->Hash, Next->Hash);
+            }
         }
 
         NextState = StateTransitions[NextState][Current->Type];
@@ -581,11 +1133,143 @@ static parse_result Parse(context *Context)
         Context->BytesRead++;
     }
 
+    if (!Current)
+    {
+        parse_result Result = {0, "unexpected end of data"};
+        return Result;
+    }
+
     Current->ByteLength = Context->BytesRead;
     parse_result Result = {Current, 0};
     return Result;
 }
 
+static u8 SameSubtree(node *A, node *B)
+{
+    return A->Type == B->Type && A->ByteLength == B->ByteLength && A->Hash == B->Hash;
+}
+
+static i32 CompareKeys(string *A, string *B)
+{
+    u32 Length = A->Length < B->Length ? A->Length : B->Length;
+    i32 Result = Length ? memcmp(A->Data, B->Data, Length) : 0;
+
+    if (Result)
+    {
+        return Result;
+    }
+
+    return (A->Length > B->Length) - (A->Length < B->Length);
+}
+
+static void PrintChange(byte *Path, u32 Length, byte *Change, u8 *First)
+{
+    printf(*First ? "{\"path\":" : ",{\"path\":");
+    PrintJSONString(Path, Length);
+    printf(",\"change\":\"%s\"}", Change);
+    *First = 0;
+}
+
+// Appends ".key" (or "[index]" when Key is 0) to Path, e.g. 'info.files[0].name'
+static u32 JoinPath(context *Context, byte **Destination, byte *Path, u32 Length, string *Key, u32 Index)
+{
+    u32 Size = Length + (Key ? Key->Length + 1 : 16);
+    byte *Buffer = PushArray(Context->Arena, byte, Size);
+    memcpy(Buffer, Path, Length);
+
+    if (Key)
+    {
+        u32 Written = Length;
+
+        if (Length)
+        {
+            Buffer[Written++] = '.';
+        }
+
+        memcpy(Buffer + Written, Key->Data, Key->Length);
+        *Destination = Buffer;
+        return Written + Key->Length;
+    }
+
+    *Destination = Buffer;
+    return Length + (u32)snprintf(Buffer + Length, 16, "[%u]", Index);
+}
+
+// NOTE: Identical subtrees are skipped through their hashes, and dict keys are expected to be sorted (as required by
+// bencode) so that both dicts can be walked in a single pass
+static void DiffNodes(context *Context, node *A, node *B, byte *Path, u32 Length, u8 *First)
+{
+    if (SameSubtree(A, B))
+    {
+        return;
+    }
+
+    if (A->Type != B->Type || A->Type == BENCODE_STR || A->Type == BENCODE_INT)
+    {
+        PrintChange(Path, Length, "changed", First);
+        return;
+    }
+
+    byte *ChildPath;
+    u32 ChildLength;
+    node *ChildA = A->Head;
+    node *ChildB = B->Head;
+
+    if (A->Type == BENCODE_LIST)
+    {
+        for (u32 Index = 0; ChildA || ChildB; Index++)
+        {
+            ChildLength = JoinPath(Context, &ChildPath, Path, Length, 0, Index);
+
+            if (ChildA && ChildB)
+            {
+                DiffNodes(Context, ChildA, ChildB, ChildPath, ChildLength, First);
+            }
+            else
+            {
+                PrintChange(ChildPath, ChildLength, ChildA ? "removed" : "added", First);
+            }
+
+            ChildA = ChildA ? ChildA->Next : 0;
+            ChildB = ChildB ? ChildB->Next : 0;
+        }
+
+        return;
+    }
+
+    while (ChildA || ChildB)
+    {
+        i32 Order = !ChildA ? 1 : !ChildB ? -1 : CompareKeys(ChildA->String, ChildB->String);
+        node *Entry = Order <= 0 ? ChildA : ChildB;
+
+        if (Order == 0 && SameSubtree(ChildA, ChildB))
+        {
+            ChildA = ChildA->Next;
+            ChildB = ChildB->Next;
+            continue;
+        }
+
+        ChildLength = JoinPath(Context, &ChildPath, Path, Length, Entry->String, 0);
+
+        if (Order == 0)
+        {
+            DiffNodes(Context, ChildA->Head, ChildB->Head, ChildPath, ChildLength, First);
+            ChildA = ChildA->Next;
+            ChildB = ChildB->Next;
+        }
+        else if (Order < 0)
+        {
+            PrintChange(ChildPath, ChildLength, "removed", First);
+            ChildA = ChildA->Next;
+        }
+        else
+        {
+            PrintChange(ChildPath, ChildLength, "added", First);
+            ChildB = ChildB->Next;
+        }
+    }
+}
+
 parse_result Torrent2JSON(context *Context)
 {
     parse_result Result = Parse(Context);
@@ -595,8 +1279,332 @@ parse_result Torrent2JSON(context *Context)
         return Result;
     }
 
+    if (Context->Format != OUTPUT_JSON)
+    {
+        PrintBinary(Context, Result.Value);
+        fflush(stdout);
+        return Result;
+    }
+
+    // NOTE: When processing several files each line is wrapped with the name of its file
+    if (Context->Filename)
+    {
+        printf("{\"file\":");
+        PrintJSONString(Context->Filename, (u32)strlen(Context->Filename));
+        printf(",\"value\":");
+    }
+
     PrintJSON(Context, Result.Value);
-    printf("\n");
+    printf(Context->Filename ? "}\n" : "\n");
+    // Keep the lines of earlier files if a later one takes the process down
+    fflush(stdout);
+    return Result;
+}
+
+parse_result Diff2JSON(context *Context, context *Other)
+{
+    Context->Flags.HashSubtrees = 1;
+    Other->Flags.HashSubtrees = 1;
+    parse_result Result = Parse(Context);
+
+    if (Result.Error)
+    {
+        return Result;
+    }
+
+    parse_result OtherResult = Parse(Other);
+
+    if (OtherResult.Error)
+    {
+        return OtherResult;
+    }
+
+    u8 First = 1;
+    printf("[");
+    DiffNodes(Context, Result.Value, OtherResult.Value, "", 0, &First);
+    printf("]\n");
+    return Result;
+}
+
+// Returns the value of Key within Dict (or 0)
+static node *FindEntry(node *Dict, byte *Key, u32 Length)
+{
+    if (!Dict || Dict->Type != BENCODE_DICT)
+    {
+        return 0;
+    }
+
+    for (node *Entry = Dict->Head; Entry; Entry = Entry->Next)
+    {
+        if (Entry->String->Length == Length && !memcmp(Entry->String->Data, Key, Length))
+        {
+            return Entry->Head;
+        }
+    }
+
+    return 0;
+}
+
+info_result TorrentInfo(context *Context)
+{
+    parse_result Result = Parse(Context);
+
+    if (Result.Error)
+    {
+        info_result InfoResult = {0, Result.Error};
+        return InfoResult;
+    }
+
+    node *Info = FindEntry(Result.Value, "info", 4);
+
+    if (!Info || Info->Type != BENCODE_DICT)
+    {
+        info_result InfoResult = {0, "no info dictionary"};
+        return InfoResult;
+    }
+
+    torrent_info *Torrent = PushStruct(Context->Arena, torrent_info);
+    byte Hash[41];
+    InfoHash(Context, Info->Parent, Hash);
+
+    for (u32 Index = 0; Index < 20; Index++)
+    {
+        u8 High = (u8)(Hash[Index * 2] <= '9' ? Hash[Index * 2] - '0' : Hash[Index * 2] - 'a' + 10);
+        u8 Low = (u8)(Hash[Index * 2 + 1] <= '9' ? Hash[Index * 2 + 1] - '0' : Hash[Index * 2 + 1] - 'a' + 10);
+        Torrent->InfoHash[Index] = (u8)(High << 4 | Low);
+    }
+
+    node *Name = FindEntry(Info, "name", 4);
+
+    if (Name && Name->Type == BENCODE_STR)
+    {
+        Torrent->Name = Name->String->Data;
+        Torrent->NameLength = Name->String->Length;
+    }
+
+    node *Length = FindEntry(Info, "length", 6);
+    node *Files = FindEntry(Info, "files", 5);
+
+    if (Length && Length->Type == BENCODE_INT)
+    {
+        Torrent->Length = (u64)Length->Integer;
+        Torrent->FileCount = 1;
+    }
+    else if (Files && Files->Type == BENCODE_LIST)
+    {
+        // Multi-file torrents: sum the length of every file
+        for (node *File = Files->Head; File; File = File->Next)
+        {
+            Length = FindEntry(File, "length", 6);
+            Torrent->Length += Length && Length->Type == BENCODE_INT ? (u64)Length->Integer : 0;
+            Torrent->FileCount++;
+        }
+    }
+
+    info_result InfoResult = {Torrent, 0};
+    return InfoResult;
+}
+
+// Returns 1 if A sorts strictly before B (as raw bytes, i.e. a prefix comes first)
+static u8 KeyLessThan(byte *A, u64 LengthA, byte *B, u64 LengthB)
+{
+    u64 Length = LengthA < LengthB ? LengthA : LengthB;
+    i32 Order = Length ? memcmp(A, B, Length) : 0;
+    return Order < 0 || (Order == 0 && LengthA < LengthB);
+}
+
+// Validates that Data is exactly one canonical bencoded value without building a tree: integers without leading zeros
+// or negative zero, dict keys strictly sorted (hence unique) and nothing after the value. String contents are skipped
+// over, only the structure is read.
+check_result CheckBencode(byte *Data, u64 Length)
+{
+    check_level Levels[CHECK_MAX_DEPTH];
+    u32 Depth = 0;
+    u64 Offset = 0;
+
+    for (;;)
+    {
+        if (Offset >= Length)
+        {
+            check_result Result = {Offset, "unexpected end of data"};
+            return Result;
+        }
+
+        check_level *Level = Depth ? &Levels[Depth - 1] : 0;
+        byte Character = Data[Offset];
+
+        if (Character == 'e')
+        {
+            if (!Level)
+            {
+                check_result Result = {Offset, "unexpected end of list or dict"};
+                return Result;
+            }
+
+            if (Level->IsDict && !Level->ExpectKey)
+            {
+                check_result Result = {Offset, "dict key without a value"};
+                return Result;
+            }
+
+            Offset++;
+            Depth--;
+        }
+        else if (Level && Level->IsDict && Level->ExpectKey && (Character < '0' || Character > '9'))
+        {
+            check_result Result = {Offset, "dict key is not a string"};
+            return Result;
+        }
+        else if (Character == 'l' || Character == 'd')
+        {
+            if (Depth == CHECK_MAX_DEPTH)
+            {
+                check_result Result = {Offset, "too deeply nested"};
+                return Result;
+            }
+
+            check_level *Next = &Levels[Depth++];
+            Next->IsDict = Character == 'd';
+            Next->ExpectKey = 1;
+            Next->Key = 0;
+            Next->KeyLength = 0;
+            Offset++;
+            // There is no completed value yet
+            continue;
+        }
+        else if (Character == 'i')
+        {
+            u64 Start = ++Offset;
+
+            if (Offset < Length && Data[Offset] == '-')
+            {
+                Offset++;
+            }
+
+            u64 Digits = Offset;
+
+            while (Offset < Length && Data[Offset] >= '0' && Data[Offset] <= '9')
+            {
+                Offset++;
+            }
+
+            if (Offset >= Length)
+            {
+                check_result Result = {Offset, "invalid integer, EOF"};
+                return Result;
+            }
+
+            if (Data[Offset] != 'e')
+            {
+                check_result Result = {Offset, "invalid integer, non-numerical"};
+                return Result;
+            }
+
+            if (Offset == Digits)
+            {
+                check_result Result = {Start, "invalid integer, empty"};
+                return Result;
+            }
+
+            if (Data[Digits] == '0' && Digits != Start)
+            {
+                check_result Result = {Start, "invalid integer, negative zero"};
+                return Result;
+            }
+
+            if (Data[Digits] == '0' && Offset - Digits > 1)
+            {
+                check_result Result = {Start, "invalid integer, leading zero"};
+                return Result;
+            }
+
+            Offset++;
+        }
+        else if (Character >= '0' && Character <= '9')
+        {
+            u64 Start = Offset;
+            u64 StringLength = 0;
+
+            while (Offset < Length && Data[Offset] >= '0' && Data[Offset] <= '9')
+            {
+                StringLength = StringLength * 10 + (u64)(Data[Offset] - '0');
+                Offset++;
+
+                // NOTE: Also guards against overflowing the length
+                if (StringLength > Length)
+                {
+                    check_result Result = {Start, "invalid string, longer than the data"};
+                    return Result;
+                }
+            }
+
+            if (Offset >= Length || Data[Offset] != ':')
+            {
+                check_result Result = {Offset, "invalid string, non-numerical character for size"};
+                return Result;
+            }
+
+            if (Data[Start] == '0' && Offset - Start > 1)
+            {
+                check_result Result = {Start, "invalid string, leading zero in size"};
+                return Result;
+            }
+
+            Offset++;
+
+            if (StringLength > Length - Offset)
+            {
+                check_result Result = {Start, "invalid string, longer than the data"};
+                return Result;
+            }
+
+            if (Level && Level->IsDict && Level->ExpectKey)
+            {
+                byte *Key = Data + Offset;
+
+                if (Level->Key && !KeyLessThan(Level->Key, Level->KeyLength, Key, StringLength))
+                {
+                    check_result Result = {Start, KeyLessThan(Key, StringLength, Level->Key, Level->KeyLength)
+                                                      ? "dict keys are not sorted"
+                                                      : "duplicate dict key"};
+                    return Result;
+                }
+
+                Level->Key = Key;
+                Level->KeyLength = StringLength;
+                Level->ExpectKey = 0;
+                Offset += StringLength;
+                // A key is not a value on its own
+                continue;
+            }
+
+            Offset += StringLength;
+        }
+        else
+        {
+            check_result Result = {Offset, "unknown leading character for bencoding"};
+            return Result;
+        }
+
+        // A value has been completed
+        if (!Depth)
+        {
+            break;
+        }
+
+        if (Levels[Depth - 1].IsDict)
+        {
+            Levels[Depth - 1].ExpectKey = 1;
+        }
+    }
+
+    if (Offset != Length)
+    {
+        check_result Result = {Offset, "trailing data after the bencoded value"};
+        return Result;
+    }
+
+    check_result Result = {Offset, 0};
     return Result;
 }
 
@@ -606,10 +1614,17 @@ void PrintUsage(void)
     fprintf(stderr, "Sebastian Bengtegård, https://github.com/trumtomte/t2j\n\n");
     fprintf(stderr, "t2j decodes bencoded files (e.g. .torrent files) into JSON.\n\n");
     fprintf(stderr, "USAGE:\n");
-    fprintf(stderr, "    t2j [OPTIONS] FILE\n");
+    fprintf(stderr, "    t2j [OPTIONS] FILE|DIRECTORY...\n");
+    fprintf(stderr, "    t2j --diff FILE FILE\n");
+    fprintf(stderr, "    t2j index build DIRECTORY [INDEX]\n");
+    fprintf(stderr, "    t2j index lookup INFO_HASH [INDEX]\n");
     fprintf(stderr, "    t2j -h\n\n");
     fprintf(stderr, "OPTIONS:\n");
     fprintf(stderr, "    -b Print binary data (otherwise marked as [BLOB] in the output).\n");
+    fprintf(stderr, "    -c Only check that the file is valid and canonical bencode\n");
+    fprintf(stderr, "       (no output, exit status 1 if not).\n");
     fprintf(stderr, "    -i Print the info (sha1) hash as part of the output.\n");
+    fprintf(stderr, "    -o FORMAT Output as json (default), cbor or msgpack (binary data is kept as is).\n");
+    fprintf(stderr, "    -u Print valid UTF-8 strings as text (otherwise only printable ASCII is).\n");
     fprintf(stderr, "    -x Print binary in hexadecimal as \"0x0A0x0B0x0C (etc.)\".\n");
 }
@@ -12,13 +12,21 @@ typedef uint64_t u64;
 typedef int32_t i32;
 typedef int64_t i64;
 
+#define SINK_SIZE 64 * 1024
+#define CHECK_MAX_DEPTH 1024
+
 typedef struct arena arena;
 typedef struct context context;
 typedef struct node node;
+typedef struct sink sink;
 typedef struct string string;
 typedef struct string_result string_result;
 typedef struct integer_result integer_result;
 typedef struct parse_result parse_result;
+typedef struct torrent_info torrent_info;
+typedef struct info_result info_result;
+typedef struct check_level check_level;
+typedef struct check_result check_result;
 
 enum bencode_type
 {
@@ -29,6 +37,13 @@ enum bencode_type
     BENCODE_DICT_ENTRY
 };
 
+enum output_format
+{
+    OUTPUT_JSON,
+    OUTPUT_CBOR,
+    OUTPUT_MSGPACK
+};
+
 enum parse_state
 {
     PARSE_EMPTY,
@@ -46,17 +61,30 @@ struct arena
     u64 Offset;
 };
 
+struct sink
+{
+    u8 Buffer[SINK_SIZE];
+    u32 Used;
+};
+
 struct context
 {
     arena *Arena;
+    sink *Sink;
     FILE *Stream;
+    byte *Filename;
     u32 BytesRead;
+    enum output_format Format;
 
     struct
     {
         u8 PrintBinary : 1;
         u8 BinaryInHex : 1;
         u8 PrintInfoHash : 1;
+        u8 AllowUTF8 : 1;
+        u8 CheckOnly : 1;
+        // Only needed (and set) when diffing
+        u8 HashSubtrees : 1;
     } Flags;
 
     // TODO: More flags:
@@ -79,6 +107,8 @@ struct node
     string *String;
     i64 Integer;
     u32 ByteLength;
+    // Content hash of the subtree (for dict entries: of both the key and the value), only with Flags.HashSubtrees
+    u64 Hash;
 };
 
 struct string_result
@@ -99,7 +129,44 @@ struct parse_result
     byte *Error;
 };
 
+// Summary of a torrent, Name points into the arena
+struct torrent_info
+{
+    u8 InfoHash[20];
+    byte *Name;
+    u32 NameLength;
+    u32 FileCount;
+    u64 Length;
+};
+
+struct info_result
+{
+    torrent_info *Value;
+    byte *Error;
+};
+
+// An open list or dict while checking, for dicts the previous key (if any) is kept to verify the order of keys
+struct check_level
+{
+    u8 IsDict;
+    u8 ExpectKey;
+    byte *Key;
+    u64 KeyLength;
+};
+
+struct check_result
+{
+    u64 Offset;
+    byte *Error;
+};
+
+typedef void visit_node(context *Context, node *Node, u8 Process);
+
 parse_result Torrent2JSON(context *Context);
+parse_result Diff2JSON(context *Context, context *Other);
+info_result TorrentInfo(context *Context);
+void PrintJSONString(byte *Data, u32 Length);
+check_result CheckBencode(byte *Data, u64 Length);
 void PrintUsage(void);
 
 #endif
@@ -1,8 +1,1167 @@
 #include "t2j.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define ARENA_SIZE 1024 * 1024 * 1024
 
+// Number of files being read ahead of the decoder, and the number of threads used when io_uring is unavailable
+#define PREFETCH_WINDOW 64
+#define PREFETCH_THREADS 16
+// Largest single read request, larger files are read in multiple steps
+#define PREFETCH_CHUNK (1 << 30)
+
+#define INDEX_MAGIC "T2JINDEX"
+#define INDEX_VERSION 1
+#define INDEX_DEFAULT_PATH "t2j.index"
+
+typedef struct prefetch_file prefetch_file;
+typedef struct prefetch_pool prefetch_pool;
+typedef struct uring uring;
+typedef struct index_header index_header;
+typedef struct index_slot index_slot;
+typedef struct index_file index_file;
+typedef struct index_record index_record;
+typedef struct index_pool index_pool;
+
+struct prefetch_file
+{
+    byte *Path;
+    byte *Label;
+    i32 Fd;
+    byte *Data;
+    u64 Size;
+    u64 Offset;
+    struct iovec Vector;
+    byte *Error;
+    u8 Done;
+};
+
+struct prefetch_pool
+{
+    prefetch_file *Files;
+    u32 Count;
+    u32 Claimed;
+    u32 Consumed;
+    pthread_mutex_t Mutex;
+    pthread_cond_t FileDone;
+    pthread_cond_t WindowMoved;
+};
+
+struct uring
+{
+    i32 Fd;
+    u32 *SQHead;
+    u32 *SQTail;
+    u32 *SQMask;
+    u32 *SQArray;
+    u32 *CQHead;
+    u32 *CQTail;
+    u32 *CQMask;
+    struct io_uring_sqe *SQEntries;
+    struct io_uring_cqe *CQEntries;
+    u32 Unsubmitted;
+};
+
+// The index file is a header, followed by Capacity slots (open addressing, with linear probing, on the info hash) and
+// then the paths and names referenced by the slots. It is meant to be used through mmap as is.
+struct index_header
+{
+    u8 Magic[8];
+    u32 Version;
+    u32 Capacity;
+    u64 Count;
+    u64 StringsOffset;
+    u64 StringsSize;
+};
+
+struct index_slot
+{
+    u8 InfoHash[20];
+    // NOTE: Empty slots have no path
+    u32 PathLength;
+    u64 PathOffset;
+    u64 NameOffset;
+    u32 NameLength;
+    u32 FileCount;
+    u64 Length;
+    i64 ModifiedTime;
+    u64 FileSize;
+};
+
+struct index_file
+{
+    index_header *Header;
+    index_slot *Slots;
+    byte *Strings;
+};
+
+// A slot before it is written, with the strings it refers to
+struct index_record
+{
+    index_slot Slot;
+    byte *Path;
+    byte *Name;
+    u8 Valid;
+};
+
+struct index_pool
+{
+    byte **Paths;
+    index_record *Records;
+    u32 Count;
+    u32 Claimed;
+    u32 Parsed;
+    // Slots of the previous index (if any), by path, to skip files which have not changed
+    index_file *Previous;
+    index_slot **PreviousByPath;
+    u32 PreviousCapacity;
+};
+
+static void PushPath(byte ***Paths, u32 *Count, u32 *Capacity, byte *Path)
+{
+    if (*Count == *Capacity)
+    {
+        *Capacity = *Capacity ? *Capacity * 2 : 64;
+        *Paths = realloc(*Paths, sizeof(byte *) * *Capacity);
+    }
+
+    (*Paths)[(*Count)++] = Path;
+}
+
+static int ComparePaths(const void *A, const void *B)
+{
+    return strcmp(*(byte *const *)A, *(byte *const *)B);
+}
+
+static u8 PushEntries(byte ***Paths, u32 *Count, u32 *Capacity, byte *Directory, u8 Recursive)
+{
+    DIR *Handle = opendir(Directory);
+
+    if (!Handle)
+    {
+        return 0;
+    }
+
+    struct dirent *Entry;
+    u64 DirectoryLength = strlen(Directory);
+
+    while ((Entry = readdir(Handle)))
+    {
+        if (Entry->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        u64 Length = DirectoryLength + strlen(Entry->d_name) + 2;
+        byte *Path = malloc(Length);
+        snprintf(Path, Length, "%s/%s", Directory, Entry->d_name);
+
+        struct stat Info;
+        if (Entry->d_type == DT_REG || (Entry->d_type == DT_UNKNOWN && !stat(Path, &Info) && S_ISREG(Info.st_mode)))
+        {
+            PushPath(Paths, Count, Capacity, Path);
+            continue;
+        }
+
+        // NOTE: Symbolic links to directories are not followed (lstat), to avoid loops
+        if (Recursive &&
+            (Entry->d_type == DT_DIR || (Entry->d_type == DT_UNKNOWN && !lstat(Path, &Info) && S_ISDIR(Info.st_mode))))
+        {
+            PushEntries(Paths, Count, Capacity, Path, Recursive);
+        }
+
+        free(Path);
+    }
+
+    closedir(Handle);
+    return 1;
+}
+
+// Adds every regular file within Directory (and its subdirectories if Recursive), sorted by path. Returns 0 if
+// Directory is not a directory.
+static u8 PushDirectory(byte ***Paths, u32 *Count, u32 *Capacity, byte *Directory, u8 Recursive)
+{
+    u32 Start = *Count;
+
+    if (!PushEntries(Paths, Count, Capacity, Directory, Recursive))
+    {
+        return 0;
+    }
+
+    // NOTE: readdir order depends on the file system
+    qsort(*Paths + Start, *Count - Start, sizeof(byte *), ComparePaths);
+    return 1;
+}
+
+// Reads a file of unknown size (e.g. a pipe or /dev/stdin) until EOF, growing the buffer as needed
+static void PrefetchReadStream(prefetch_file *File)
+{
+    u64 Capacity = 0;
+
+    for (;;)
+    {
+        if (File->Size == Capacity)
+        {
+            Capacity = Capacity ? Capacity * 2 : 64 * 1024;
+            File->Data = realloc(File->Data, Capacity);
+        }
+
+        i64 Bytes = read(File->Fd, File->Data + File->Size, Capacity - File->Size);
+
+        if (Bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (Bytes < 0)
+        {
+            File->Error = "unable to read file";
+            return;
+        }
+
+        if (Bytes == 0)
+        {
+            break;
+        }
+
+        File->Size += (u64)Bytes;
+    }
+
+    File->Offset = File->Size;
+
+    if (!File->Size)
+    {
+        File->Error = "empty file";
+    }
+}
+
+// Opens the file and allocates a buffer for its content, returns 1 if the content is left to be read (with pread or
+// io_uring). Files which are not regular (or report no size) are read here and 0 is returned, as on failure (Error).
+static u8 PrefetchOpen(prefetch_file *File)
+{
+    struct stat Info;
+    File->Fd = open(File->Path, O_RDONLY);
+
+    if (File->Fd < 0 || fstat(File->Fd, &Info) < 0)
+    {
+        File->Error = "unable to read file";
+        return 0;
+    }
+
+    File->Size = 0;
+    File->Offset = 0;
+
+    if (!S_ISREG(Info.st_mode) || !Info.st_size)
+    {
+        PrefetchReadStream(File);
+        return 0;
+    }
+
+    File->Size = (u64)Info.st_size;
+    File->Data = malloc(File->Size);
+    return 1;
+}
+
+static void PrefetchClose(prefetch_file *File)
+{
+    if (File->Fd >= 0)
+    {
+        close(File->Fd);
+        File->Fd = -1;
+    }
+}
+
+// Reads the content of an opened file with (blocking) pread calls
+static void PrefetchRead(prefetch_file *File)
+{
+    while (File->Offset < File->Size)
+    {
+        u64 Remaining = File->Size - File->Offset;
+        i64 Bytes = pread(File->Fd, File->Data + File->Offset, Remaining < PREFETCH_CHUNK ? Remaining : PREFETCH_CHUNK,
+                          (off_t)File->Offset);
+
+        if (Bytes < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (Bytes < 0)
+        {
+            File->Error = "unable to read file";
+            break;
+        }
+
+        if (Bytes == 0)
+        {
+            File->Size = File->Offset;
+            break;
+        }
+
+        File->Offset += (u64)Bytes;
+    }
+}
+
+static void ArenaReset(arena *Arena)
+{
+    void *Base = (u8 *)Arena->Memory - Arena->Offset;
+    // NOTE: Nodes rely on zeroed memory
+    memset(Base, 0, Arena->Offset);
+    Arena->Memory = Base;
+    Arena->Offset = 0;
+}
+
+// Decodes (and prints) or checks a file once its content has been read, returns 1 on success
+static u8 ProcessFile(context *Context, prefetch_file *File)
+{
+    u8 Success = 0;
+
+    if (File->Error)
+    {
+        fprintf(stderr, "t2j: %s: %s\n", File->Path, File->Error);
+    }
+    else if (Context->Flags.CheckOnly)
+    {
+        check_result Result = CheckBencode(File->Data, File->Size);
+
+        if (Result.Error)
+        {
+            fprintf(stderr, "t2j: %s: %s (at offset %lu)\n", File->Path, Result.Error, Result.Offset);
+        }
+        else
+        {
+            Success = 1;
+        }
+    }
+    else
+    {
+        // Every file gets a fresh arena and feeds the (stream based) decoder from memory
+        Context->Stream = fmemopen(File->Data, File->Size, "r");
+        Context->Filename = File->Label;
+        Context->BytesRead = 0;
+        parse_result Result = Torrent2JSON(Context);
+        fclose(Context->Stream);
+        ArenaReset(Context->Arena);
+
+        if (Result.Error)
+        {
+            fprintf(stderr, "t2j: %s: %s\n", File->Path, Result.Error);
+        }
+        else
+        {
+            Success = 1;
+        }
+    }
+
+    free(File->Data);
+    File->Data = 0;
+    return Success;
+}
+
+static u8 UringSetup(uring *Ring, u32 Entries)
+{
+    struct io_uring_params Params = {0};
+    Ring->Fd = (i32)syscall(__NR_io_uring_setup, Entries, &Params);
+
+    if (Ring->Fd < 0)
+    {
+        return 0;
+    }
+
+    u64 SQSize = Params.sq_off.array + Params.sq_entries * sizeof(u32);
+    u64 CQSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (Params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        SQSize = CQSize = SQSize > CQSize ? SQSize : CQSize;
+    }
+
+    u8 *SQ = mmap(0, SQSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQ_RING);
+    u8 *CQ = SQ;
+
+    if (!(Params.features & IORING_FEAT_SINGLE_MMAP) && SQ != MAP_FAILED)
+    {
+        CQ = mmap(0, CQSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_CQ_RING);
+    }
+
+    void *SQEntries = mmap(0, Params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQES);
+
+    if (SQ == MAP_FAILED || CQ == MAP_FAILED || SQEntries == MAP_FAILED)
+    {
+        close(Ring->Fd);
+        return 0;
+    }
+
+    Ring->SQHead = (u32 *)(SQ + Params.sq_off.head);
+    Ring->SQTail = (u32 *)(SQ + Params.sq_off.tail);
+    Ring->SQMask = (u32 *)(SQ + Params.sq_off.ring_mask);
+    Ring->SQArray = (u32 *)(SQ + Params.sq_off.array);
+    Ring->CQHead = (u32 *)(CQ + Params.cq_off.head);
+    Ring->CQTail = (u32 *)(CQ + Params.cq_off.tail);
+    Ring->CQMask = (u32 *)(CQ + Params.cq_off.ring_mask);
+    Ring->SQEntries = SQEntries;
+    Ring->CQEntries = (struct io_uring_cqe *)(CQ + Params.cq_off.cqes);
+    Ring->Unsubmitted = 0;
+    return 1;
+}
+
+// Queues a read of the remaining content of File, UserData is the index of the file
+static void UringRead(uring *Ring, prefetch_file *File, u64 UserData)
+{
+    u64 Remaining = File->Size - File->Offset;
+    File->Vector.iov_base = File->Data + File->Offset;
+    File->Vector.iov_len = Remaining < PREFETCH_CHUNK ? Remaining : PREFETCH_CHUNK;
+
+    u32 Tail = *Ring->SQTail;
+    u32 Index = Tail & *Ring->SQMask;
+    struct io_uring_sqe *Entry = &Ring->SQEntries[Index];
+    memset(Entry, 0, sizeof(*Entry));
+    // NOTE: READV (rather than READ) to support older kernels
+    Entry->opcode = IORING_OP_READV;
+    Entry->fd = File->Fd;
+    Entry->addr = (u64)&File->Vector;
+    Entry->len = 1;
+    Entry->off = File->Offset;
+    Entry->user_data = UserData;
+    Ring->SQArray[Index] = Index;
+    __atomic_store_n(Ring->SQTail, Tail + 1, __ATOMIC_RELEASE);
+    Ring->Unsubmitted++;
+}
+
+// Submits queued reads and handles completions, waits for at least one completion if Wait is set
+static u8 UringPoll(uring *Ring, prefetch_file *Files, u8 Wait)
+{
+    i64 Status = syscall(__NR_io_uring_enter, Ring->Fd, Ring->Unsubmitted, Wait ? 1 : 0,
+                         Wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+
+    if (Status < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        return 0;
+    }
+
+    if (Status > 0)
+    {
+        Ring->Unsubmitted -= (u32)Status;
+    }
+
+    u32 Head = *Ring->CQHead;
+    u32 Tail = __atomic_load_n(Ring->CQTail, __ATOMIC_ACQUIRE);
+
+    while (Head != Tail)
+    {
+        struct io_uring_cqe *Entry = &Ring->CQEntries[Head & *Ring->CQMask];
+        prefetch_file *File = &Files[Entry->user_data];
+        Head++;
+
+        if (Entry->res == -EINTR || Entry->res == -EAGAIN)
+        {
+            UringRead(Ring, File, Entry->user_data);
+            continue;
+        }
+
+        if (Entry->res < 0)
+        {
+            File->Error = "unable to read file";
+        }
+        else if (Entry->res == 0)
+        {
+            // The file shrunk since we looked at its size
+            File->Size = File->Offset;
+        }
+        else
+        {
+            File->Offset += (u64)Entry->res;
+
+            if (File->Offset < File->Size)
+            {
+                UringRead(Ring, File, Entry->user_data);
+                continue;
+            }
+        }
+
+        PrefetchClose(File);
+        File->Done = 1;
+    }
+
+    __atomic_store_n(Ring->CQHead, Head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static u32 ProcessFilesThreaded(context *Context, prefetch_file *Files, u32 Count);
+
+// When io_uring fails, reads still in flight may write into their buffers at any time. Those buffers are abandoned
+// (never freed) and every file which is not done yet is read again by the pread fallback.
+static u32 UringAbandon(context *Context, uring *Ring, prefetch_file *Files, u32 Submitted, u32 Count)
+{
+    for (u32 Index = 0; Index < Submitted; Index++)
+    {
+        prefetch_file *File = &Files[Index];
+
+        if (!File->Done)
+        {
+            // NOTE: The ring keeps its own reference to the file, so closing it here is safe
+            PrefetchClose(File);
+            File->Data = 0;
+            File->Size = 0;
+            File->Offset = 0;
+            File->Error = 0;
+        }
+    }
+
+    close(Ring->Fd);
+    return ProcessFilesThreaded(Context, Files, Count);
+}
+
+// Keeps up to PREFETCH_WINDOW reads in flight through io_uring while files are decoded in order
+static u32 ProcessFilesUring(context *Context, uring *Ring, prefetch_file *Files, u32 Count)
+{
+    u32 Submitted = 0;
+    u32 Failures = 0;
+
+    for (u32 Consumed = 0; Consumed < Count; Consumed++)
+    {
+        // NOTE: open/fstat are still blocking, only the reads are asynchronous
+        while (Submitted < Count && Submitted < Consumed + PREFETCH_WINDOW)
+        {
+            prefetch_file *File = &Files[Submitted];
+
+            if (PrefetchOpen(File))
+            {
+                UringRead(Ring, File, Submitted);
+            }
+            else
+            {
+                PrefetchClose(File);
+                File->Done = 1;
+            }
+
+            Submitted++;
+        }
+
+        u8 Wait = 0;
+        while (!Files[Consumed].Done)
+        {
+            if (!UringPoll(Ring, Files, Wait))
+            {
+                return Failures + UringAbandon(Context, Ring, Files + Consumed, Submitted - Consumed, Count - Consumed);
+            }
+
+            Wait = 1;
+        }
+
+        Failures += !ProcessFile(Context, &Files[Consumed]);
+    }
+
+    return Failures;
+}
+
+static void *PrefetchWorker(void *Argument)
+{
+    prefetch_pool *Pool = Argument;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&Pool->Mutex);
+
+        while (Pool->Claimed < Pool->Count && Pool->Claimed >= Pool->Consumed + PREFETCH_WINDOW)
+        {
+            pthread_cond_wait(&Pool->WindowMoved, &Pool->Mutex);
+        }
+
+        if (Pool->Claimed >= Pool->Count)
+        {
+            pthread_mutex_unlock(&Pool->Mutex);
+            return 0;
+        }
+
+        prefetch_file *File = &Pool->Files[Pool->Claimed++];
+        pthread_mutex_unlock(&Pool->Mutex);
+
+        // NOTE: Files can already be done when taking over from io_uring
+        if (!File->Done)
+        {
+            if (PrefetchOpen(File))
+            {
+                PrefetchRead(File);
+            }
+
+            PrefetchClose(File);
+        }
+
+        pthread_mutex_lock(&Pool->Mutex);
+        File->Done = 1;
+        pthread_cond_broadcast(&Pool->FileDone);
+        pthread_mutex_unlock(&Pool->Mutex);
+    }
+}
+
+// Fallback when io_uring is unavailable: a pool of threads reading ahead with pread
+static u32 ProcessFilesThreaded(context *Context, prefetch_file *Files, u32 Count)
+{
+    prefetch_pool Pool = {0};
+    Pool.Files = Files;
+    Pool.Count = Count;
+    pthread_mutex_init(&Pool.Mutex, 0);
+    pthread_cond_init(&Pool.FileDone, 0);
+    pthread_cond_init(&Pool.WindowMoved, 0);
+
+    u32 ThreadCount = Count < PREFETCH_THREADS ? Count : PREFETCH_THREADS;
+    pthread_t Threads[PREFETCH_THREADS];
+
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        pthread_create(&Threads[ThreadIndex], 0, PrefetchWorker, &Pool);
+    }
+
+    u32 Failures = 0;
+
+    for (u32 Consumed = 0; Consumed < Count; Consumed++)
+    {
+        pthread_mutex_lock(&Pool.Mutex);
+
+        while (!Files[Consumed].Done)
+        {
+            pthread_cond_wait(&Pool.FileDone, &Pool.Mutex);
+        }
+
+        pthread_mutex_unlock(&Pool.Mutex);
+
+        Failures += !ProcessFile(Context, &Files[Consumed]);
+
+        pthread_mutex_lock(&Pool.Mutex);
+        Pool.Consumed = Consumed + 1;
+        pthread_cond_broadcast(&Pool.WindowMoved);
+        pthread_mutex_unlock(&Pool.Mutex);
+    }
+
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        pthread_join(Threads[ThreadIndex], 0);
+    }
+
+    return Failures;
+}
+
+static u32 IndexHome(u8 *InfoHash, u32 Capacity)
+{
+    u64 Key;
+    memcpy(&Key, InfoHash, sizeof(Key));
+    return (u32)(Key & (Capacity - 1));
+}
+
+static u32 PathHome(byte *Path, u32 Length, u32 Capacity)
+{
+    // FNV-1a
+    u64 Hash = 0xCBF29CE484222325ULL;
+
+    for (u32 Index = 0; Index < Length; Index++)
+    {
+        Hash = (Hash ^ (u8)Path[Index]) * 0x100000001B3ULL;
+    }
+
+    return (u32)(Hash & (Capacity - 1));
+}
+
+static u8 IndexOpen(index_file *Index, byte *Path)
+{
+    struct stat Info;
+    i32 Fd = open(Path, O_RDONLY);
+
+    if (Fd < 0 || fstat(Fd, &Info) < 0 || (u64)Info.st_size < sizeof(index_header))
+    {
+        if (Fd >= 0)
+        {
+            close(Fd);
+        }
+
+        return 0;
+    }
+
+    u64 Size = (u64)Info.st_size;
+    u8 *Memory = mmap(0, Size, PROT_READ, MAP_SHARED, Fd, 0);
+    close(Fd);
+
+    if (Memory == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    index_header *Header = (index_header *)Memory;
+    u64 SlotsEnd = sizeof(index_header) + (u64)Header->Capacity * sizeof(index_slot);
+
+    // NOTE: Lookups rely on (at least half of the) slots being empty, sizes are compared without adding them up so that
+    // a corrupt header can't overflow past the checks
+    if (memcmp(Header->Magic, INDEX_MAGIC, 8) || Header->Version != INDEX_VERSION || !Header->Capacity ||
+        (Header->Capacity & (Header->Capacity - 1)) || Header->Count > Header->Capacity / 2 ||
+        SlotsEnd > Header->StringsOffset || Header->StringsOffset > Size ||
+        Header->StringsSize > Size - Header->StringsOffset)
+    {
+        munmap(Memory, Size);
+        return 0;
+    }
+
+    Index->Header = Header;
+    Index->Slots = (index_slot *)(Memory + sizeof(index_header));
+    Index->Strings = (byte *)Memory + Header->StringsOffset;
+    return 1;
+}
+
+// Returns 1 if the strings of Slot are within the strings of the index
+static u8 IndexSlotValid(index_file *Index, index_slot *Slot)
+{
+    u64 Size = Index->Header->StringsSize;
+    return Slot->PathOffset <= Size && Slot->PathLength <= Size - Slot->PathOffset && Slot->NameOffset <= Size &&
+           Slot->NameLength <= Size - Slot->NameOffset;
+}
+
+// Checks every slot, and that the number of used slots matches the header (so that probing always ends)
+static u8 IndexValidate(index_file *Index)
+{
+    u64 Used = 0;
+
+    for (u32 SlotIndex = 0; SlotIndex < Index->Header->Capacity; SlotIndex++)
+    {
+        index_slot *Slot = &Index->Slots[SlotIndex];
+
+        if (Slot->PathLength)
+        {
+            if (!IndexSlotValid(Index, Slot))
+            {
+                return 0;
+            }
+
+            Used++;
+        }
+    }
+
+    return Used == Index->Header->Count;
+}
+
+static index_slot *FindPreviousSlot(index_pool *Pool, byte *Path)
+{
+    if (!Pool->PreviousCapacity)
+    {
+        return 0;
+    }
+
+    u32 Length = (u32)strlen(Path);
+    u32 Mask = Pool->PreviousCapacity - 1;
+
+    for (u32 Index = PathHome(Path, Length, Pool->PreviousCapacity); Pool->PreviousByPath[Index];
+         Index = (Index + 1) & Mask)
+    {
+        index_slot *Slot = Pool->PreviousByPath[Index];
+
+        if (Slot->PathLength == Length && !memcmp(Pool->Previous->Strings + Slot->PathOffset, Path, Length))
+        {
+            return Slot;
+        }
+    }
+
+    return 0;
+}
+
+// Every thread has its own arena and decodes whole files, unchanged files are taken from the previous index
+static void *IndexWorker(void *Argument)
+{
+    index_pool *Pool = Argument;
+    arena Arena = {0};
+    Arena.Memory = mmap(0, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    context Context = {0};
+    Context.Arena = &Arena;
+
+    for (;;)
+    {
+        u32 Index = __atomic_fetch_add(&Pool->Claimed, 1, __ATOMIC_RELAXED);
+
+        if (Index >= Pool->Count)
+        {
+            break;
+        }
+
+        index_record *Record = &Pool->Records[Index];
+        prefetch_file File = {0};
+        File.Path = Pool->Paths[Index];
+        File.Fd = -1;
+
+        struct stat Info;
+        if (stat(File.Path, &Info) < 0)
+        {
+            fprintf(stderr, "t2j: %s: unable to read file\n", File.Path);
+            continue;
+        }
+
+        index_slot *Previous = FindPreviousSlot(Pool, File.Path);
+
+        // NOTE: Nanoseconds, since files can be rewritten within the same second
+        i64 ModifiedTime = (i64)Info.st_mtim.tv_sec * 1000000000 + Info.st_mtim.tv_nsec;
+
+        if (Previous && Previous->ModifiedTime == ModifiedTime && Previous->FileSize == (u64)Info.st_size)
+        {
+            Record->Slot = *Previous;
+            Record->Path = File.Path;
+            Record->Name = Pool->Previous->Strings + Previous->NameOffset;
+            Record->Valid = 1;
+            continue;
+        }
+
+        if (PrefetchOpen(&File))
+        {
+            PrefetchRead(&File);
+        }
+
+        PrefetchClose(&File);
+
+        if (File.Error)
+        {
+            fprintf(stderr, "t2j: %s: %s\n", File.Path, File.Error);
+            free(File.Data);
+            continue;
+        }
+
+        Context.Stream = fmemopen(File.Data, File.Size, "r");
+        Context.BytesRead = 0;
+        info_result Result = TorrentInfo(&Context);
+        fclose(Context.Stream);
+
+        if (Result.Error)
+        {
+            fprintf(stderr, "t2j: %s: %s\n", File.Path, Result.Error);
+        }
+        else
+        {
+            torrent_info *Torrent = Result.Value;
+            memcpy(Record->Slot.InfoHash, Torrent->InfoHash, sizeof(Torrent->InfoHash));
+            Record->Slot.NameLength = Torrent->NameLength;
+            Record->Slot.FileCount = Torrent->FileCount;
+            Record->Slot.Length = Torrent->Length;
+            Record->Slot.ModifiedTime = ModifiedTime;
+            Record->Slot.FileSize = (u64)Info.st_size;
+            Record->Path = File.Path;
+            Record->Name = malloc(Torrent->NameLength ? Torrent->NameLength : 1);
+            memcpy(Record->Name, Torrent->Name, Torrent->NameLength);
+            Record->Valid = 1;
+            __atomic_fetch_add(&Pool->Parsed, 1, __ATOMIC_RELAXED);
+        }
+
+        free(File.Data);
+        ArenaReset(&Arena);
+    }
+
+    munmap((u8 *)Arena.Memory - Arena.Offset, ARENA_SIZE);
+    return 0;
+}
+
+// Writes the index next to IndexPath and then renames it, so that readers never see a partial index
+static u8 IndexWrite(byte *IndexPath, index_record **Records, u32 Count)
+{
+    u32 Capacity = 16;
+
+    // NOTE: At most half of the slots are used
+    while (Capacity < Count * 2)
+    {
+        Capacity *= 2;
+    }
+
+    index_slot *Slots = calloc(Capacity, sizeof(index_slot));
+    u64 StringsSize = 0;
+
+    for (u32 RecordIndex = 0; RecordIndex < Count; RecordIndex++)
+    {
+        StringsSize += Records[RecordIndex]->Slot.PathLength + Records[RecordIndex]->Slot.NameLength;
+    }
+
+    byte *Strings = malloc(StringsSize ? StringsSize : 1);
+    u64 Offset = 0;
+
+    for (u32 RecordIndex = 0; RecordIndex < Count; RecordIndex++)
+    {
+        index_record *Record = Records[RecordIndex];
+        u32 Index = IndexHome(Record->Slot.InfoHash, Capacity);
+
+        while (Slots[Index].PathLength)
+        {
+            Index = (Index + 1) & (Capacity - 1);
+        }
+
+        index_slot *Slot = &Slots[Index];
+        *Slot = Record->Slot;
+        Slot->PathOffset = Offset;
+        memcpy(Strings + Offset, Record->Path, Slot->PathLength);
+        Offset += Slot->PathLength;
+        Slot->NameOffset = Offset;
+        memcpy(Strings + Offset, Record->Name, Slot->NameLength);
+        Offset += Slot->NameLength;
+    }
+
+    index_header Header = {0};
+    memcpy(Header.Magic, INDEX_MAGIC, 8);
+    Header.Version = INDEX_VERSION;
+    Header.Capacity = Capacity;
+    Header.Count = Count;
+    Header.StringsOffset = sizeof(index_header) + (u64)Capacity * sizeof(index_slot);
+    Header.StringsSize = StringsSize;
+
+    u64 TemporaryLength = strlen(IndexPath) + 5;
+    byte *TemporaryPath = malloc(TemporaryLength);
+    snprintf(TemporaryPath, TemporaryLength, "%s.tmp", IndexPath);
+    FILE *Stream = fopen(TemporaryPath, "wb");
+
+    u8 Success = Stream && fwrite(&Header, sizeof(Header), 1, Stream) == 1 &&
+                 fwrite(Slots, sizeof(index_slot), Capacity, Stream) == Capacity &&
+                 fwrite(Strings, sizeof(byte), StringsSize, Stream) == StringsSize;
+
+    if (Stream && fclose(Stream))
+    {
+        Success = 0;
+    }
+
+    Success = Success && !rename(TemporaryPath, IndexPath);
+    free(TemporaryPath);
+    free(Strings);
+    free(Slots);
+    return Success;
+}
+
+// Returns 1 if Path is a file within Directory (or any of its subdirectories)
+static u8 WithinDirectory(byte *Path, u32 Length, byte *Directory, u32 DirectoryLength)
+{
+    return Length > DirectoryLength + 1 && !memcmp(Path, Directory, DirectoryLength) && Path[DirectoryLength] == '/';
+}
+
+// Indexes every file within Directory (recursively). Entries of a previous index are kept for other directories, and
+// files which have not changed (same size and modification time) are not decoded again.
+static int IndexBuild(byte *Directory, byte *IndexPath)
+{
+    byte *Root = realpath(Directory, 0);
+    byte **Paths = 0;
+    u32 PathCount = 0;
+    u32 PathCapacity = 0;
+
+    if (!Root || !PushDirectory(&Paths, &PathCount, &PathCapacity, Root, 1))
+    {
+        fprintf(stderr, "t2j: unable to read directory %s\n", Directory);
+        return 1;
+    }
+
+    index_file Previous = {0};
+    index_pool Pool = {0};
+    Pool.Paths = Paths;
+    Pool.Count = PathCount;
+    Pool.Records = calloc(PathCount ? PathCount : 1, sizeof(index_record));
+    Pool.Previous = &Previous;
+
+    u8 HasPrevious = IndexOpen(&Previous, IndexPath);
+
+    if (HasPrevious && !IndexValidate(&Previous))
+    {
+        fprintf(stderr, "t2j: ignoring corrupt index %s\n", IndexPath);
+        Previous.Header = 0;
+        HasPrevious = 0;
+    }
+
+    if (HasPrevious)
+    {
+        Pool.PreviousCapacity = 16;
+
+        while (Pool.PreviousCapacity < Previous.Header->Count * 2)
+        {
+            Pool.PreviousCapacity *= 2;
+        }
+
+        Pool.PreviousByPath = calloc(Pool.PreviousCapacity, sizeof(index_slot *));
+        u32 Mask = Pool.PreviousCapacity - 1;
+
+        for (u32 SlotIndex = 0; SlotIndex < Previous.Header->Capacity; SlotIndex++)
+        {
+            index_slot *Slot = &Previous.Slots[SlotIndex];
+
+            if (!Slot->PathLength)
+            {
+                continue;
+            }
+
+            u32 Index = PathHome(Previous.Strings + Slot->PathOffset, Slot->PathLength, Pool.PreviousCapacity);
+
+            while (Pool.PreviousByPath[Index])
+            {
+                Index = (Index + 1) & Mask;
+            }
+
+            Pool.PreviousByPath[Index] = Slot;
+        }
+    }
+
+    u32 ThreadCount = PathCount < PREFETCH_THREADS ? PathCount : PREFETCH_THREADS;
+    pthread_t Threads[PREFETCH_THREADS];
+
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        pthread_create(&Threads[ThreadIndex], 0, IndexWorker, &Pool);
+    }
+
+    for (u32 ThreadIndex = 0; ThreadIndex < ThreadCount; ThreadIndex++)
+    {
+        pthread_join(Threads[ThreadIndex], 0);
+    }
+
+    u64 PreviousCount = Previous.Header ? Previous.Header->Count : 0;
+    index_record **Records = calloc(PathCount + PreviousCount + 1, sizeof(index_record *));
+    index_record *Kept = calloc(PreviousCount + 1, sizeof(index_record));
+    u32 Count = 0;
+    u32 KeptCount = 0;
+    u32 Failed = 0;
+
+    for (u32 RecordIndex = 0; RecordIndex < PathCount; RecordIndex++)
+    {
+        index_record *Record = &Pool.Records[RecordIndex];
+
+        if (Record->Valid)
+        {
+            Record->Slot.PathLength = (u32)strlen(Record->Path);
+            Records[Count++] = Record;
+        }
+        else
+        {
+            Failed++;
+        }
+    }
+
+    // NOTE: Entries within the directory we just read are replaced (or removed), everything else is kept
+    u32 RootLength = (u32)strlen(Root);
+    for (u32 SlotIndex = 0; Previous.Header && SlotIndex < Previous.Header->Capacity; SlotIndex++)
+    {
+        index_slot *Slot = &Previous.Slots[SlotIndex];
+        byte *Path = Previous.Strings + Slot->PathOffset;
+
+        if (Slot->PathLength && !WithinDirectory(Path, Slot->PathLength, Root, RootLength))
+        {
+            index_record *Record = &Kept[KeptCount++];
+            Record->Slot = *Slot;
+            Record->Path = Path;
+            Record->Name = Previous.Strings + Slot->NameOffset;
+            Records[Count++] = Record;
+        }
+    }
+
+    if (!IndexWrite(IndexPath, Records, Count))
+    {
+        fprintf(stderr, "t2j: unable to write index %s\n", IndexPath);
+        return 1;
+    }
+
+    printf("{\"indexed\":%u,\"parsed\":%u,\"failed\":%u}\n", Count, Pool.Parsed, Failed);
+    return 0;
+}
+
+static int IndexLookup(byte *Hex, byte *IndexPath)
+{
+    u8 InfoHash[20];
+
+    for (u32 Index = 0; Index < 40; Index++)
+    {
+        byte Character = Hex[Index];
+        u8 Value = Character >= '0' && Character <= '9'   ? (u8)(Character - '0')
+                   : Character >= 'a' && Character <= 'f' ? (u8)(Character - 'a' + 10)
+                   : Character >= 'A' && Character <= 'F' ? (u8)(Character - 'A' + 10)
+                                                          : 0xFF;
+
+        if (Value == 0xFF)
+        {
+            fprintf(stderr, "t2j: invalid info hash %s\n", Hex);
+            return 1;
+        }
+
+        InfoHash[Index / 2] = Index % 2 ? (u8)(InfoHash[Index / 2] | Value) : (u8)(Value << 4);
+    }
+
+    if (Hex[40] != '\0')
+    {
+        fprintf(stderr, "t2j: invalid info hash %s\n", Hex);
+        return 1;
+    }
+
+    index_file Index = {0};
+
+    if (!IndexOpen(&Index, IndexPath))
+    {
+        fprintf(stderr, "t2j: unable to read index %s\n", IndexPath);
+        return 1;
+    }
+
+    u32 Capacity = Index.Header->Capacity;
+    u8 Found = 0;
+    u32 SlotIndex = IndexHome(InfoHash, Capacity);
+
+    // NOTE: The same torrent can be found in several files, print them all. Slots are only checked when used (rather
+    // than all of them when opening) to keep lookups fast, and probing is bounded in case no slot is empty.
+    for (u32 Probe = 0; Probe < Capacity && Index.Slots[SlotIndex].PathLength;
+         Probe++, SlotIndex = (SlotIndex + 1) & (Capacity - 1))
+    {
+        index_slot *Slot = &Index.Slots[SlotIndex];
+
+        if (memcmp(Slot->InfoHash, InfoHash, sizeof(InfoHash)))
+        {
+            continue;
+        }
+
+        if (!IndexSlotValid(&Index, Slot))
+        {
+            fprintf(stderr, "t2j: corrupt index %s\n", IndexPath);
+            return 1;
+        }
+
+        printf("{\"info_hash\":\"");
+        for (u32 ByteIndex = 0; ByteIndex < 20; ByteIndex++)
+        {
+            printf("%02x", Slot->InfoHash[ByteIndex]);
+        }
+        printf("\",\"path\":");
+        PrintJSONString(Index.Strings + Slot->PathOffset, Slot->PathLength);
+        printf(",\"name\":");
+        PrintJSONString(Index.Strings + Slot->NameOffset, Slot->NameLength);
+        printf(",\"length\":%lu,\"files\":%u}\n", Slot->Length, Slot->FileCount);
+        Found = 1;
+    }
+
+    return Found ? 0 : 1;
+}
+
+static int IndexMain(int argc, char **argv)
+{
+    byte *IndexPath = argc > 4 ? (byte *)argv[4] : INDEX_DEFAULT_PATH;
+
+    if (argc < 4 || argc > 5)
+    {
+        PrintUsage();
+        return 0;
+    }
+
+    if (!strcmp(argv[2], "build"))
+    {
+        return IndexBuild((byte *)argv[3], IndexPath);
+    }
+
+    if (!strcmp(argv[2], "lookup"))
+    {
+        return IndexLookup((byte *)argv[3], IndexPath);
+    }
+
+    fprintf(stderr, "t2j: unknown index command %s\n", argv[2]);
+    PrintUsage();
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     if (argc < 2)
@@ -11,12 +1170,22 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    if (!strcmp(argv[1], "index"))
+    {
+        return IndexMain(argc, argv);
+    }
+
     arena Arena = {0};
     Arena.Memory = mmap(0, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     context Context = {0};
     Context.Arena = &Arena;
 
-    byte *Filename = 0;
+    byte **Paths = 0;
+    u32 PathCount = 0;
+    u32 PathCapacity = 0;
+    u8 ReadDirectory = 0;
+    u8 Diff = 0;
+
     for (u16 ArgIndex = 1; ArgIndex < argc; ArgIndex++)
     {
         byte *Arg = (byte *)argv[ArgIndex];
@@ -26,15 +1195,53 @@ int main(int argc, char **argv)
             // TODO: Allow combining flags
             switch (*Arg)
             {
+            case '-':
+                if (strcmp(Arg, "-diff"))
+                {
+                    fprintf(stderr, "t2j: illegal option -%s\n", Arg);
+                    PrintUsage();
+                    return 0;
+                }
+
+                Diff = 1;
+                break;
             case 'b':
                 Context.Flags.PrintBinary = 1;
                 break;
+            case 'c':
+                Context.Flags.CheckOnly = 1;
+                break;
             case 'x':
                 Context.Flags.BinaryInHex = 1;
                 break;
             case 'i':
                 Context.Flags.PrintInfoHash = 1;
                 break;
+            case 'u':
+                Context.Flags.AllowUTF8 = 1;
+                break;
+            case 'o':
+                Arg = ArgIndex + 1 < argc ? (byte *)argv[++ArgIndex] : "";
+
+                if (!strcmp(Arg, "json"))
+                {
+                    Context.Format = OUTPUT_JSON;
+                }
+                else if (!strcmp(Arg, "cbor"))
+                {
+                    Context.Format = OUTPUT_CBOR;
+                }
+                else if (!strcmp(Arg, "msgpack"))
+                {
+                    Context.Format = OUTPUT_MSGPACK;
+                }
+                else
+                {
+                    fprintf(stderr, "t2j: unknown output format %s\n", Arg);
+                    PrintUsage();
+                    return 0;
+                }
+                break;
             case 'h':
                 PrintUsage();
                 return 0;
@@ -45,34 +1252,75 @@ int main(int argc, char **argv)
                 return 0;
             }
         }
+        else if (!Diff && PushDirectory(&Paths, &PathCount, &PathCapacity, Arg, 0))
+        {
+            ReadDirectory = 1;
+        }
         else
         {
-            Filename = Arg;
+            PushPath(&Paths, &PathCount, &PathCapacity, Arg);
         }
     }
 
-    if (!Filename)
+    if (!PathCount && !ReadDirectory)
     {
         // TODO: read from stdin, if empty, then PrintUsage
         PrintUsage();
         return 0;
     }
 
-    Context.Stream = fopen(Filename, "r");
+    if (Diff)
+    {
+        if (PathCount != 2)
+        {
+            PrintUsage();
+            return 0;
+        }
+
+        context Other = Context;
+        Context.Stream = fopen(Paths[0], "r");
+        Other.Stream = fopen(Paths[1], "r");
+
+        if (!Context.Stream || !Other.Stream)
+        {
+            fprintf(stderr, "t2j: unable to read file %s\n", Context.Stream ? Paths[1] : Paths[0]);
+            return 1;
+        }
+
+        parse_result Result = Diff2JSON(&Context, &Other);
+
+        if (Result.Error)
+        {
+            fprintf(stderr, "t2j: %s\n", Result.Error);
+            return 1;
+        }
+
+        return 0;
+    }
+
+    prefetch_file *Files = calloc(PathCount ? PathCount : 1, sizeof(prefetch_file));
 
-    if (!Context.Stream)
+    // NOTE: A single file is printed as-is, otherwise one line (labeled with its file) per file
+    u8 Labeled = PathCount > 1 || ReadDirectory;
+
+    for (u32 PathIndex = 0; PathIndex < PathCount; PathIndex++)
     {
-        fprintf(stderr, "t2j: unable to read file %s\n", Filename);
-        return 1;
+        Files[PathIndex].Path = Paths[PathIndex];
+        Files[PathIndex].Label = Labeled ? Paths[PathIndex] : 0;
+        Files[PathIndex].Fd = -1;
     }
 
-    parse_result Result = Torrent2JSON(&Context);
+    u32 Failures = 0;
+    uring Ring = {0};
 
-    if (Result.Error)
+    if (PathCount && UringSetup(&Ring, PREFETCH_WINDOW))
     {
-        fprintf(stderr, "t2j: %s\n", Result.Error);
-        return 1;
+        Failures = ProcessFilesUring(&Context, &Ring, Files, PathCount);
+    }
+    else
+    {
+        Failures = ProcessFilesThreaded(&Context, Files, PathCount);
     }
 
-    return 0;
+    return Failures ? 1 : 0;
 }